@@ -0,0 +1,116 @@
+/**
+ * @file bwdelayshm.h
+ * @author agent
+ * @date 18 Oct 2026
+ *
+ * Shared-memory stats ring of the bandwidth-delay tester
+ * The server (producer) publishes one fixed-layout record per reporting interval into a ring in a shared-memory file.
+ * Readers (e.g. bwdelayshmreader) map the same file read-only and tail it.
+ *
+ * The ring is single-producer and lock-free: the producer never waits for a reader. A slow reader simply gets overwritten,
+ * which it detects through the per-record sequence number.
+ */
+#ifndef BWDELAYSHM_H
+#define BWDELAYSHM_H
+
+/* ***********************************************************************************************************************************************
+ * Include Files
+ * ***********************************************************************************************************************************************
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * ***********************************************************************************************************************************************
+ * Defines
+ * ***********************************************************************************************************************************************
+ */
+#define BDT_SHM_MAGIC           0x31474e4952544442ULL   /* "BDTRING1" */
+#define BDT_SHM_VERSION         1
+#define BDT_SHM_RECORDS         4096                    /* Ring capacity. At 0.1s intervals, this holds almost 7 minutes */
+
+#define BDT_SHM_FLAG_TSC        0x1                     /* Producer uses the TSC timestamp source; tscerr_ns is meaningful */
+
+/*
+ * ***********************************************************************************************************************************************
+ * Types
+ * ***********************************************************************************************************************************************
+ */
+
+/*
+ * One reporting interval. Same content as the server's stdout columns, plus the latency percentiles of the interval
+ */
+typedef struct bdt_shmrecord
+{
+    uint64_t seq;               /* Odd while being written, 2*(index+1) once record <index> is complete */
+    uint64_t timestamp_us;      /* Server time at the end of the interval */
+    uint64_t bytes;             /* Bytes per second */
+    uint64_t packets;           /* Packets per second */
+    uint64_t drops;
+    uint64_t drops_consq;
+    int64_t mindelay_us;
+    int64_t maxdelay_us;
+    int64_t avgdelay_us;
+    uint64_t tscerr_ns;         /* Worst TSC conversion error of the interval */
+    int64_t p50_us;             /* Latency percentiles of the interval (upper bound of the histogram bucket) */
+    int64_t p90_us;
+    int64_t p99_us;
+    int64_t p999_us;
+} bdt_shmrecord;
+
+typedef struct bdt_shmring
+{
+    uint64_t magic;             /* Written last by the producer, once the ring is initialised */
+    uint32_t version;
+    uint32_t recordsize;
+    uint32_t capacity;
+    uint32_t flags;
+    uint64_t pad0[5];
+
+    uint64_t writeidx;          /* Amount of records published so far. Own cache line, only written by the producer */
+    uint64_t pad1[7];
+
+    bdt_shmrecord records[BDT_SHM_RECORDS];
+} bdt_shmring;
+
+/*
+ * ***********************************************************************************************************************************************
+ * Inline Functions
+ * ***********************************************************************************************************************************************
+ */
+
+/*
+ * Producer: publish the next record. Never blocks
+ */
+static inline void bdt_shm_publish(bdt_shmring *ring, const bdt_shmrecord *rec)
+{
+    uint64_t idx = ring->writeidx;
+    bdt_shmrecord *slot = &ring->records[idx % BDT_SHM_RECORDS];
+
+    __atomic_store_n(&slot->seq, 2*idx + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *)slot + sizeof(slot->seq), (const char *)rec + sizeof(rec->seq), sizeof(*rec) - sizeof(rec->seq));
+    __atomic_store_n(&slot->seq, 2*idx + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->writeidx, idx + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Reader: copy out record <idx>. Returns false if it is not (or no longer) available, e.g. because the producer overwrote it
+ */
+static inline bool bdt_shm_read(const bdt_shmring *ring, uint64_t idx, bdt_shmrecord *out)
+{
+    const bdt_shmrecord *slot = &ring->records[idx % BDT_SHM_RECORDS];
+
+    uint64_t seq1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if(seq1 != 2*idx + 2) {
+        return false;
+    }
+    memcpy(out, slot, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq1;
+}
+
+#endif /* BWDELAYSHM_H */
+
+/* End of file bwdelayshm.h */
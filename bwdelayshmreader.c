@@ -0,0 +1,225 @@
+/**
+ * @file bwdelayshmreader.c
+ * @author agent
+ * @date 18 Oct 2026
+ *
+ * Shared-memory stats ring reader
+ * Tails the interval records which a bwdelaytester server (-o <shmfile>) publishes, and prints them as gnuplot-friendly text or CSV.
+ * The reader only maps the file read-only: a slow reader never stalls the server, it just loses (and reports) overwritten records.
+ */
+
+/* ***********************************************************************************************************************************************
+ * Include Files
+ * ***********************************************************************************************************************************************
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bwdelayshm.h"
+
+/*
+ * ***********************************************************************************************************************************************
+ * Defines
+ * ***********************************************************************************************************************************************
+ */
+#define POLL_INTERVAL_NS        (10*1000*1000) /* Time to sleep when no new record is available */
+
+/*
+ * ***********************************************************************************************************************************************
+ * Local Members
+ * ***********************************************************************************************************************************************
+ */
+
+/*
+ * Global program variables
+ */
+struct progsettings
+{
+    char *prgname;
+    char *shmfile;
+    bool csv;                   /* False: space separated text (same columns as the server stdout), True: CSV with a header row */
+    uint64_t backlog;           /* Amount of already published records to print first */
+} progsettings;
+
+/*
+ * ***********************************************************************************************************************************************
+ * Private Functions
+ * ***********************************************************************************************************************************************
+ */
+
+static void die(char *s)
+{
+    perror(s);
+    exit(1);
+}
+
+/*
+ * Map the ring, waiting for the server to create and initialise it if needed
+ */
+static const bdt_shmring *openRing()
+{
+    struct timespec poll = { .tv_sec = 0, .tv_nsec = POLL_INTERVAL_NS };
+    const bdt_shmring *ring;
+    struct stat st;
+    int fd;
+
+    while((fd = open(progsettings.shmfile, O_RDONLY)) < 0 || fstat(fd, &st) || st.st_size < (off_t)sizeof(bdt_shmring)) {
+        if(fd >= 0) {
+            close(fd);
+        } else if(errno != ENOENT) {
+            die("open shared memory file");
+        }
+        nanosleep(&poll, NULL);
+    }
+
+    ring = mmap(NULL, sizeof(bdt_shmring), PROT_READ, MAP_SHARED, fd, 0);
+    if(ring == MAP_FAILED) {
+        die("mmap shared memory file");
+    }
+    close(fd);
+
+    while(__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != BDT_SHM_MAGIC) {
+        nanosleep(&poll, NULL);
+    }
+    if(ring->version != BDT_SHM_VERSION || ring->recordsize != sizeof(bdt_shmrecord) || ring->capacity != BDT_SHM_RECORDS) {
+        fprintf(stderr, "Incompatible shared memory ring (version %u, record size %u, capacity %u)\n", ring->version, ring->recordsize, ring->capacity);
+        exit(1);
+    }
+    return ring;
+}
+
+static void printHeader()
+{
+    if(progsettings.csv) {
+        printf("timestamp_us,bytes,packets,drops,drops_consq,mindelay_us,maxdelay_us,avgdelay_us,tscerr_ns,p50_us,p90_us,p99_us,p999_us\n");
+    } else {
+        printf("# bytes_last_intv packets_last_intv drops_last_intv drops_consq_last_intv mindelayus_last_intv maxdelayus_last_intv avgdelayus_last_intv tscerrns_last_intv p50us_last_intv p90us_last_intv p99us_last_intv p999us_last_intv\n");
+    }
+}
+
+static void printRecord(const bdt_shmrecord *rec)
+{
+    if(progsettings.csv) {
+        printf("%lu,%lu,%lu,%lu,%lu,%ld,%ld,%ld,%lu,%ld,%ld,%ld,%ld\n", rec->timestamp_us, rec->bytes, rec->packets, rec->drops, rec->drops_consq,
+               rec->mindelay_us, rec->maxdelay_us, rec->avgdelay_us, rec->tscerr_ns, rec->p50_us, rec->p90_us, rec->p99_us, rec->p999_us);
+    } else {
+        /* Columns 1..7 are identical to the server stdout, so the existing gnuplot scripts keep working */
+        printf("%lu %lu %lu %lu %ld %ld %ld %lu %ld %ld %ld %ld\n", rec->bytes, rec->packets, rec->drops, rec->drops_consq,
+               rec->mindelay_us, rec->maxdelay_us, rec->avgdelay_us, rec->tscerr_ns, rec->p50_us, rec->p90_us, rec->p99_us, rec->p999_us);
+    }
+}
+
+/*
+ * Follow the ring forever
+ */
+static void tailRing(const bdt_shmring *ring)
+{
+    struct timespec poll = { .tv_sec = 0, .tv_nsec = POLL_INTERVAL_NS };
+    bdt_shmrecord rec;
+    uint64_t writeidx = __atomic_load_n(&ring->writeidx, __ATOMIC_ACQUIRE);
+    uint64_t backlog = progsettings.backlog < BDT_SHM_RECORDS ? progsettings.backlog : BDT_SHM_RECORDS; /* The ring holds no more than this */
+    uint64_t readidx = writeidx > backlog ? writeidx - backlog : 0;
+
+    printHeader();
+    fflush(stdout);
+
+    while(1) {
+        writeidx = __atomic_load_n(&ring->writeidx, __ATOMIC_ACQUIRE);
+
+        if(writeidx < readidx) {
+            /* The server restarted and reinitialised the ring */
+            fprintf(stderr, "WARNING: Server restarted. Restarting here too\n");
+            readidx = 0;
+            continue;
+        }
+        if(writeidx == readidx) {
+            nanosleep(&poll, NULL);
+            continue;
+        }
+        if(writeidx - readidx > BDT_SHM_RECORDS) {
+            fprintf(stderr, "WARNING: Reader too slow, lost %lu records\n", writeidx - readidx - BDT_SHM_RECORDS);
+            readidx = writeidx - BDT_SHM_RECORDS;
+        }
+
+        while(readidx < writeidx) {
+            if(bdt_shm_read(ring, readidx, &rec)) {
+                printRecord(&rec);
+            } else {
+                /* Overwritten by the server in the meantime */
+                fprintf(stderr, "WARNING: Reader too slow, lost record %lu\n", readidx);
+            }
+            readidx++;
+        }
+        fflush(stdout);
+    }
+}
+
+static void print_usage_and_exit() {
+    printf("\n");
+    printf("Bandwidth-delay tester shared memory reader. \n");
+    printf("\n");
+    printf(" Tail the interval records a bwdelaytester server publishes with -o <shmfile>\n");
+    printf("\t\n");
+    printf("\tUsage: %s [-f text|csv] [-n <backlog>] <shmfile>\n",  progsettings.prgname);
+    printf("\t \n");
+    printf("\t -Text output has the same columns as the server stdout, followed by tscerrns p50us p90us p99us p999us. (default)\n");
+    printf("\t -CSV output has a header row, and starts with the server timestamp (us)\n");
+    printf("\t -Optionally the last <backlog> already published records are printed first\n");
+    printf("\t \n");
+    printf("\t Example live plotting, as with the server stdout: \n");
+    printf("\t \n");
+    printf("\t\t SERVER:  bwdelaytester -o /dev/shm/bwdelay \n");
+    printf("\t\t READER:  %s /dev/shm/bwdelay | nc 10.0.0.129 1234 \n",  progsettings.prgname);
+    printf("\t \n");
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * ***********************************************************************************************************************************************
+ * Public Functions
+ * ***********************************************************************************************************************************************
+ */
+
+int main(int argc, char *argv[])
+{
+    int option = 0;
+
+    progsettings.prgname = argv[0];
+    while ((option = getopt(argc, argv,"f:n:")) != -1) {
+        switch (option) {
+        case 'f':
+            if(!strcmp(optarg, "csv")) {
+                progsettings.csv = true;
+            } else if(strcmp(optarg, "text")) {
+                print_usage_and_exit();
+            }
+            break;
+        case 'n':
+            progsettings.backlog = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            print_usage_and_exit();
+            break;
+        }
+    }
+    if(optind != argc - 1) {
+        print_usage_and_exit();
+    }
+    progsettings.shmfile = argv[optind];
+
+    tailRing(openRing());
+
+    return 0;
+}
+
+/* End of file bwdelayshmreader.c */
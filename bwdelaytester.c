@@ -37,6 +37,7 @@
  * Include Files
  * ***********************************************************************************************************************************************
  */
+#define _GNU_SOURCE /* CPU affinity */
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -50,6 +51,18 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <poll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC                1
+#endif
+
+#include "bwdelayshm.h"
 
 /*
  * ***********************************************************************************************************************************************
@@ -75,6 +88,27 @@
 #define LATHIST_MAX_LATMS       20
 #define LATHIST_QUEUECOUNT      100
 
+/* Per-interval latency percentiles (shared memory output) */
+#define PCTL_RES_US             10          /* Resolution of the per-interval histogram. Range is LATHIST_MAX_LATMS */
+#define PCTL_QUEUECOUNT         (LATHIST_MAX_LATMS*1000/PCTL_RES_US)
+
+/* TSC timestamp source */
+#define TSC_CALIBRATION_US      50000       /* Initial measuring window to determine the TSC frequency */
+#define TSC_REANCHOR_NS         1000000000  /* Re-anchor the TSC to the kernel clock (and refine its rate) every second */
+#define TSC_ANCHOR_ATTEMPTS     5           /* Take the tightest TSC/kernel clock pair out of this many attempts */
+#define TSC_STEP_THRESHOLD_NS   1000000     /* A larger conversion error means the kernel clock was stepped: re-anchor, but keep the rate */
+
+/* Prometheus/OpenMetrics exporter */
+#define EXPORTER_REQBUFLEN      2048        /* Only the request line matters. Rest of the request is read and ignored */
+#define EXPORTER_DEADLINE_MS    2000        /* Overall time a client gets to send its request and read the response */
+#define PEER_STRLEN             32          /* "255.255.255.255:65535" */
+
+/* Real-time mode */
+#define PREFAULT_STACK_BYTES    (256*1024)  /* Stack area to touch upfront when locking memory */
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL     69          /* Linux 5.11+, not yet in all libc headers */
+#endif
+
 #define xstr(s) str(s)
 #define str(s) #s
 
@@ -112,8 +146,44 @@ struct progsettings
     char *sourceifbind;         /* If nonzero, string to specify interface to bind to (e.g. for VRF) */
     bool sweepmode;             /* If enabled, will sweep from 1/BWDELAYGRAPHTICKS to BWDELAYGRAPHTICKS/BWDELAYGRAPHTICKS ratio of bw */
     bool nonsyncedclocks;       /* Clocks on sender and receiver are not very accurately synced (< 0.1ms) (e.g. through PTP) */
+    bool tsctimestamps;         /* Use the invariant TSC instead of clock_gettime() for timestamping and pacing */
+
+    /* Real-time mode */
+    int pincpu;                 /* If >= 0, CPU to pin the client/server thread to */
+    int fifopriority;           /* If nonzero, run with SCHED_FIFO at this priority */
+    bool lockmemory;            /* mlockall and pre-fault buffers, to avoid page faults during the test */
+    int busypollus;             /* If nonzero, server socket SO_BUSY_POLL time in us (and SO_PREFER_BUSY_POLL) */
+    bool spinreceive;           /* Server polls the socket non-blocking in a loop instead of sleeping in recvfrom() */
+
+    char *shmfile;              /* If nonzero, server publishes interval records in this shared memory file instead of printing them */
+    int exporterport;           /* If nonzero, server serves Prometheus metrics over HTTP on this TCP port */
 } progsettings;
 
+/*
+ * TSC based clock, anchored to a kernel clock (CLOCK_REALTIME or CLOCK_MONOTONIC).
+ * Timestamps are extrapolated from the last anchor point using the measured TSC rate.
+ * Every TSC_REANCHOR_NS the kernel clock is read again, the extrapolation error is recorded, and the rate is refined.
+ * The rate is only ever measured against CLOCK_MONOTONIC, which never steps. CLOCK_REALTIME shares that rate, and only uses its own anchor as offset.
+ */
+struct tscclock
+{
+    clockid_t clockid;
+    uint64_t base_tsc;
+    uint64_t base_ns;
+    double nspertick;
+    int64_t reanchor_ticks;
+
+    uint64_t anchorwindow_ns;   /* Uncertainty of the last anchor pair read (TSC ticks elapsed around clock_gettime()) */
+    int64_t lasterr_ns;         /* Extrapolated minus actual kernel time, at the last re-anchor */
+    uint64_t maxabserr_ns;      /* Worst absolute conversion error seen since start */
+    uint64_t maxabserr_intv_ns; /* Worst absolute conversion error seen since last interval report */
+    uint64_t reanchors;
+    uint64_t steps;             /* Re-anchors caused by a kernel clock step (error above TSC_STEP_THRESHOLD_NS) */
+    uint64_t last_ns;           /* CLOCK_MONOTONIC only: latest time handed out. Corrections never make it go backwards */
+} tscclocks[2]; /* [0] CLOCK_REALTIME, [1] CLOCK_MONOTONIC */
+
+bool tscactive; /* Only set once the TSC has been verified invariant and calibrated */
+
 /*
  * Binning for sweep mode struct
  */
@@ -130,6 +200,40 @@ struct bwdelaypoint
 
 
 uint64_t latencyhits[LATHIST_QUEUECOUNT];
+uint64_t latencyhits_intv[PCTL_QUEUECOUNT]; /* Finer histogram of the current interval only, for percentiles */
+
+int64_t latencysum;                         /* Sum of all latencies in latencyhits[], updated every interval */
+
+bdt_shmring *shmring; /* Shared memory output, if enabled */
+
+/*
+ * Statistics of the current session (sender run). A new session starts when the remote restarts its counter.
+ * Owned by the receive path, and updated every interval
+ */
+struct sessionstats
+{
+    uint64_t session;           /* Sequence number of the session since server start */
+    char peer[PEER_STRLEN];     /* Sender ip:port */
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t drops;
+    uint64_t drops_consq;
+    int64_t mindelay_us;        /* Of the last interval */
+    int64_t maxdelay_us;
+    int64_t avgdelay_us;
+} sessionstats;
+
+/*
+ * Copy of the server statistics for the exporter thread. Seqlock protected: the receive path never waits for a scrape
+ */
+struct statssnapshot
+{
+    uint64_t seq;               /* Odd while being updated */
+    struct sessionstats session;
+    int64_t latencysum;
+    uint64_t latencyhits[LATHIST_QUEUECOUNT];
+    struct bwdelaypoint bwdelaypoints[GRAPH_BWBUCKETS];
+} statssnapshot;
 /*
  * ***********************************************************************************************************************************************
  * Private Function Prototypes
@@ -150,8 +254,12 @@ static void die(char *s)
     exit(1);
 }
 
+static void tsc_printsummary(void);
+
 void sig_handler(int signum)
 {
+    tsc_printsummary();
+
     /*
      * If we were the server, first print overall latency histogram data
      */
@@ -215,33 +323,607 @@ static int nsleep(uint64_t nsleep)
 #endif
 }
 
-static int busywait_nsleep(uint64_t nsleep)
+static uint64_t kernelclock_ns(clockid_t clockid)
 {
     struct timespec time1;
+    clock_gettime(clockid, &time1);
+    return (uint64_t)time1.tv_sec * 1000000000 + time1.tv_nsec;
+}
+
+#ifdef HAVE_TSC
+/*
+ * Read a TSC/kernel clock pair. The TSC is read before and after clock_gettime(), and the midpoint is taken.
+ * Out of a few attempts, the pair with the smallest window is kept (least likely to be disturbed by an interrupt)
+ */
+static void tsc_readanchor(struct tscclock *c, uint64_t *tsc, uint64_t *ns, uint64_t *window_ticks)
+{
+    *window_ticks = UINT64_MAX;
+    for(int i = 0; i < TSC_ANCHOR_ATTEMPTS; i++) {
+        uint64_t t1 = __rdtsc();
+        uint64_t now = kernelclock_ns(c->clockid);
+        uint64_t t2 = __rdtsc();
+        if(t2 - t1 < *window_ticks) {
+            *window_ticks = t2 - t1;
+            *tsc = t1 + (t2 - t1)/2;
+            *ns = now;
+        }
+    }
+}
+
+/*
+ * Compare the extrapolated TSC time against the kernel clock, and record the conversion error
+ */
+static uint64_t tsc_measureerror(struct tscclock *c, uint64_t *tsc, uint64_t *ns, uint64_t *window_ticks)
+{
+    tsc_readanchor(c, tsc, ns, window_ticks);
+
+    int64_t elapsed_ticks = *tsc - c->base_tsc;
+    int64_t err = (int64_t)(c->base_ns + (int64_t)(elapsed_ticks * c->nspertick)) - (int64_t)*ns;
+    uint64_t abserr = err < 0 ? -err : err;
+
+    c->lasterr_ns = err;
+    if(abserr > c->maxabserr_ns) c->maxabserr_ns = abserr;
+    if(abserr > c->maxabserr_intv_ns) c->maxabserr_intv_ns = abserr;
+    return abserr;
+}
+
+/*
+ * Measure the conversion error, and restart the extrapolation from a fresh anchor
+ */
+static void tsc_reanchor(struct tscclock *c)
+{
+    struct tscclock *mono = &tscclocks[1];
+    uint64_t tsc, ns, window_ticks;
+
+    /* CLOCK_REALTIME borrows the rate of CLOCK_MONOTONIC, so keep that one fresh too (e.g. the server only timestamps with CLOCK_REALTIME) */
+    if(c != mono && (int64_t)(__rdtsc() - mono->base_tsc) > mono->reanchor_ticks) {
+        tsc_reanchor(mono);
+    }
+
+    uint64_t abserr = tsc_measureerror(c, &tsc, &ns, &window_ticks);
+    int64_t elapsed_ticks = tsc - c->base_tsc;
+
+    if(abserr >= TSC_STEP_THRESHOLD_NS) {
+        /* The kernel clock was stepped (or we were suspended): follow it, but don't derive a rate from the step */
+        c->steps++;
+    } else if(c == mono && elapsed_ticks > c->reanchor_ticks/2) {
+        /* Only refine the rate over a sufficiently long span (e.g. not when we were migrated to a core with a slightly lagging TSC) */
+        c->nspertick = (double)((int64_t)(ns - c->base_ns)) / (double)elapsed_ticks;
+        c->reanchor_ticks = TSC_REANCHOR_NS / c->nspertick;
+    }
+    if(c != mono) {
+        c->nspertick = mono->nspertick;
+        c->reanchor_ticks = mono->reanchor_ticks;
+    }
+
+    c->anchorwindow_ns = window_ticks * c->nspertick;
+    c->reanchors++;
+    c->base_tsc = tsc;
+    c->base_ns = ns;
+}
+
+static bool tsc_isinvariant(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return edx & (1 << 8); /* Invariant TSC: constant rate, and keeps running in deep C-states */
+}
+#endif
+
+/*
+ * Select the timestamp source.
+ * If requested and supported, calibrate the TSC against both kernel clocks. Otherwise keep using (vDSO) clock_gettime()
+ */
+static void tsc_init(void)
+{
+    if(!progsettings.tsctimestamps) {
+        return;
+    }
+#ifdef HAVE_TSC
+    if(!tsc_isinvariant()) {
+        fprintf(stderr, "WARNING: CPU lacks an invariant TSC. Falling back to clock_gettime()\n");
+        return;
+    }
+
+    uint64_t starttsc[2], startns[2], window_ticks;
+    tscclocks[0].clockid = CLOCK_REALTIME;
+    tscclocks[1].clockid = CLOCK_MONOTONIC;
+    for(int i = 0; i < 2; i++) {
+        tsc_readanchor(&tscclocks[i], &starttsc[i], &startns[i], &window_ticks);
+    }
+    usleep(TSC_CALIBRATION_US);
+    for(int i = 0; i < 2; i++) {
+        struct tscclock *c = &tscclocks[i];
+        tsc_readanchor(c, &c->base_tsc, &c->base_ns, &window_ticks);
+    }
+    /* The rate comes from CLOCK_MONOTONIC only, which cannot be stepped during the calibration */
+    tscclocks[1].nspertick = (double)(tscclocks[1].base_ns - startns[1]) / (double)(tscclocks[1].base_tsc - starttsc[1]);
+    for(int i = 0; i < 2; i++) {
+        struct tscclock *c = &tscclocks[i];
+        c->nspertick = tscclocks[1].nspertick;
+        c->reanchor_ticks = TSC_REANCHOR_NS / c->nspertick;
+        c->anchorwindow_ns = window_ticks * c->nspertick;
+    }
+    tscactive = true;
+
+    fprintf(stderr, "Timestamp source: TSC at %.3f MHz, anchor uncertainty %lu ns, re-anchored every %u ms\n",
+            1000.0/tscclocks[1].nspertick, tscclocks[1].anchorwindow_ns, TSC_REANCHOR_NS/1000000);
+#else
+    fprintf(stderr, "WARNING: No TSC support on this architecture. Falling back to clock_gettime()\n");
+#endif
+}
+
+/*
+ * Get the current time in ns of the given kernel clock (CLOCK_REALTIME or CLOCK_MONOTONIC), from the selected timestamp source
+ */
+static inline uint64_t gettime_ns(clockid_t clockid)
+{
+#ifdef HAVE_TSC
+    if(tscactive) {
+        struct tscclock *c = &tscclocks[clockid == CLOCK_MONOTONIC];
+        int64_t elapsed_ticks = __rdtsc() - c->base_tsc;
+        uint64_t now;
+        if(elapsed_ticks < 0 || elapsed_ticks > c->reanchor_ticks) {
+            tsc_reanchor(c);
+            now = c->base_ns;
+        } else {
+            now = c->base_ns + (uint64_t)(elapsed_ticks * c->nspertick);
+        }
+        /*
+         * CLOCK_MONOTONIC (pacing): if the extrapolation was ahead at re-anchor, hold the clock until the kernel time catches up, rather than stepping back.
+         * CLOCK_REALTIME (on-wire timestamps) follows the kernel clock, steps included, just like clock_gettime() would
+         */
+        if(clockid == CLOCK_MONOTONIC) {
+            if(now < c->last_ns) {
+                return c->last_ns;
+            }
+            c->last_ns = now;
+        }
+        return now;
+    }
+#endif
+    return kernelclock_ns(clockid);
+}
+
+/*
+ * Worst absolute TSC conversion error since the previous call (0 when not using the TSC)
+ * The error is measured against the kernel clock on every call as well, so each reporting interval has at least one measurement
+ */
+static uint64_t tsc_takeintervalerror(clockid_t clockid)
+{
+    struct tscclock *c = &tscclocks[clockid == CLOCK_MONOTONIC];
+#ifdef HAVE_TSC
+    if(tscactive) {
+        uint64_t tsc, ns, window_ticks;
+        if(tsc_measureerror(c, &tsc, &ns, &window_ticks) >= TSC_STEP_THRESHOLD_NS) {
+            /* Kernel clock step: follow it right away, instead of at the next periodic re-anchor */
+            tsc_reanchor(c);
+        }
+    }
+#endif
+    uint64_t err = c->maxabserr_intv_ns;
+    c->maxabserr_intv_ns = 0;
+    return err;
+}
+
+static void tsc_printsummary(void)
+{
+    if(!tscactive) {
+        return;
+    }
+    fprintf(stderr, "## TSC timestamp source: %.3f MHz\n", 1000.0/tscclocks[1].nspertick);
+    for(int i = 0; i < 2; i++) {
+        fprintf(stderr, "## %s: %lu re-anchors (%lu clock steps), last error %ld ns, max abs error %lu ns, anchor uncertainty %lu ns\n",
+                tscclocks[i].clockid == CLOCK_REALTIME ? "CLOCK_REALTIME" : "CLOCK_MONOTONIC",
+                tscclocks[i].reanchors, tscclocks[i].steps, tscclocks[i].lasterr_ns, tscclocks[i].maxabserr_ns, tscclocks[i].anchorwindow_ns);
+    }
+}
+
+static int busywait_nsleep(uint64_t nsleep)
+{
     uint64_t localtstamp, now;
-    clock_gettime(CLOCK_MONOTONIC , &time1);
-    localtstamp = time1.tv_sec * 1000000000 + time1.tv_nsec;
+    localtstamp = gettime_ns(CLOCK_MONOTONIC);
 
     while(1) {
-        clock_gettime(CLOCK_MONOTONIC , &time1);
-        now = time1.tv_sec * 1000000000 + time1.tv_nsec;
+        now = gettime_ns(CLOCK_MONOTONIC);
         if(now - localtstamp > nsleep)
             break;
     }
 }
 
 
+/*
+ * Touch the stack upfront, so the pages are mapped (and locked) before the test starts
+ */
+static void __attribute__((noinline)) prefaultstack(void)
+{
+    volatile char stack[PREFAULT_STACK_BYTES];
+    memset((char *)stack, 0, sizeof(stack));
+}
+
+/*
+ * Real-time mode
+ * Apply the requested process settings to reduce scheduler noise in the measurements, and report whether each took effect.
+ * Failures are not fatal: the test runs anyway, but the user knows the latency floor may include scheduler noise.
+ */
+static void applyRealtimeSettings()
+{
+    if(progsettings.pincpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(progsettings.pincpu, &cpus);
+        if(sched_setaffinity(0, sizeof(cpus), &cpus)) {
+            fprintf(stderr, "RT: pin to CPU %d: FAILED (%s)\n", progsettings.pincpu, strerror(errno));
+        } else {
+            fprintf(stderr, "RT: pin to CPU %d: OK\n", progsettings.pincpu);
+        }
+    }
+
+    if(progsettings.fifopriority) {
+        struct sched_param param = { .sched_priority = progsettings.fifopriority };
+        if(sched_setscheduler(0, SCHED_FIFO, &param)) {
+            fprintf(stderr, "RT: SCHED_FIFO priority %d: FAILED (%s)\n", progsettings.fifopriority, strerror(errno));
+        } else {
+            fprintf(stderr, "RT: SCHED_FIFO priority %d: OK\n", progsettings.fifopriority);
+        }
+    }
+
+    if(progsettings.lockmemory) {
+        if(mlockall(MCL_CURRENT | MCL_FUTURE)) {
+            fprintf(stderr, "RT: mlockall: FAILED (%s)\n", strerror(errno));
+        } else {
+            fprintf(stderr, "RT: mlockall: OK\n");
+        }
+        /* Pre-fault the stack and the statistics arrays. The packet buffers are touched by the callers */
+        prefaultstack();
+        memset(latencyhits, 0, sizeof(latencyhits));
+        memset(bwdelaypoints, 0, sizeof(bwdelaypoints));
+        memset(latencyhits_intv, 0, sizeof(latencyhits_intv));
+    }
+}
+
+/*
+ * Real-time mode, server socket part: busy polling on the receive queue
+ */
+static void applyRealtimeSocketSettings(int s)
+{
+    if(progsettings.busypollus) {
+        int val = progsettings.busypollus;
+        if(setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val))) {
+            fprintf(stderr, "RT: SO_BUSY_POLL %d us: FAILED (%s)\n", val, strerror(errno));
+        } else {
+            fprintf(stderr, "RT: SO_BUSY_POLL %d us: OK\n", val);
+        }
+        val = 1;
+        if(setsockopt(s, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val))) {
+            fprintf(stderr, "RT: SO_PREFER_BUSY_POLL: FAILED (%s)\n", strerror(errno));
+        } else {
+            fprintf(stderr, "RT: SO_PREFER_BUSY_POLL: OK\n");
+        }
+    }
+
+    if(progsettings.spinreceive) {
+        fprintf(stderr, "RT: spin receive (non-blocking recvfrom loop): OK\n");
+    }
+}
+
+/*
+ * Shared memory output
+ * Create (or reuse) the file, size it for the ring, and map it. Readers can attach at any time
+ */
+static void shm_init()
+{
+    int fd = open(progsettings.shmfile, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+        die("open shared memory file");
+    }
+    if(ftruncate(fd, sizeof(bdt_shmring))) {
+        die("ftruncate shared memory file");
+    }
+    shmring = mmap(NULL, sizeof(bdt_shmring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(shmring == MAP_FAILED) {
+        die("mmap shared memory file");
+    }
+    close(fd);
+
+    /* Start from a clean ring (also pre-faults it). Readers attached to a previous run see the write index going back, and restart */
+    memset(shmring, 0, sizeof(bdt_shmring));
+    shmring->version = BDT_SHM_VERSION;
+    shmring->recordsize = sizeof(bdt_shmrecord);
+    shmring->capacity = BDT_SHM_RECORDS;
+    shmring->flags = tscactive ? BDT_SHM_FLAG_TSC : 0;
+    __atomic_store_n(&shmring->magic, BDT_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    fprintf(stderr, "Publishing interval records in shared memory file %s\n", progsettings.shmfile);
+}
+
+/*
+ * Exporter
+ * Publish the current statistics for the exporter thread. Called once per interval from the receive path
+ */
+static void publishStatsSnapshot()
+{
+    __atomic_store_n(&statssnapshot.seq, statssnapshot.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    statssnapshot.session = sessionstats;
+    statssnapshot.latencysum = latencysum;
+    memcpy(statssnapshot.latencyhits, latencyhits, sizeof(latencyhits));
+    memcpy(statssnapshot.bwdelaypoints, bwdelaypoints, sizeof(bwdelaypoints));
+    __atomic_store_n(&statssnapshot.seq, statssnapshot.seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Exporter
+ * Take a consistent copy of the statistics, retrying if the receive path updated them meanwhile
+ */
+static void readStatsSnapshot(struct statssnapshot *copy)
+{
+    uint64_t seq;
+    while(1) {
+        seq = __atomic_load_n(&statssnapshot.seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, &statssnapshot, sizeof(*copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&statssnapshot.seq, __ATOMIC_RELAXED) == seq) {
+            return;
+        }
+    }
+}
+
+/*
+ * Exporter
+ * Format the statistics in the Prometheus text exposition format
+ */
+static void writeMetrics(FILE *f, const struct statssnapshot *snap)
+{
+    const struct sessionstats *ses = &snap->session;
+
+    if(ses->peer[0]) {
+        char labels[PEER_STRLEN+32];
+        snprintf(labels, sizeof(labels), "session=\"%lu\",peer=\"%s\"", ses->session, ses->peer);
+
+        fprintf(f, "# HELP bwdelay_packets_total Packets received in the session.\n# TYPE bwdelay_packets_total counter\n");
+        fprintf(f, "bwdelay_packets_total{%s} %lu\n", labels, ses->packets);
+        fprintf(f, "# HELP bwdelay_bytes_total Bytes received in the session.\n# TYPE bwdelay_bytes_total counter\n");
+        fprintf(f, "bwdelay_bytes_total{%s} %lu\n", labels, ses->bytes);
+        fprintf(f, "# HELP bwdelay_drops_total Packets dropped in the session.\n# TYPE bwdelay_drops_total counter\n");
+        fprintf(f, "bwdelay_drops_total{%s} %lu\n", labels, ses->drops);
+        fprintf(f, "# HELP bwdelay_drop_events_total Drop events (consecutive drops count once) in the session.\n# TYPE bwdelay_drop_events_total counter\n");
+        fprintf(f, "bwdelay_drop_events_total{%s} %lu\n", labels, ses->drops_consq);
+        fprintf(f, "# HELP bwdelay_delay_min_microseconds Minimum delay of the last interval.\n# TYPE bwdelay_delay_min_microseconds gauge\n");
+        fprintf(f, "bwdelay_delay_min_microseconds{%s} %ld\n", labels, ses->mindelay_us);
+        fprintf(f, "# HELP bwdelay_delay_avg_microseconds Average delay of the last interval.\n# TYPE bwdelay_delay_avg_microseconds gauge\n");
+        fprintf(f, "bwdelay_delay_avg_microseconds{%s} %ld\n", labels, ses->avgdelay_us);
+        fprintf(f, "# HELP bwdelay_delay_max_microseconds Maximum delay of the last interval.\n# TYPE bwdelay_delay_max_microseconds gauge\n");
+        fprintf(f, "bwdelay_delay_max_microseconds{%s} %ld\n", labels, ses->maxdelay_us);
+    }
+
+    /*
+     * Latency histogram since server start. Bucket i holds the (integer us) delays in [i*res, (i+1)*res), so its inclusive bound is (i+1)*res-1.
+     * The last bucket also holds all higher latencies, so it maps on +Inf
+     */
+    uint64_t cumul = 0;
+    fprintf(f, "# HELP bwdelay_latency_microseconds Packet latency since server start.\n# TYPE bwdelay_latency_microseconds histogram\n");
+    for(int i = 0; i < LATHIST_QUEUECOUNT-1; i++) {
+        cumul += snap->latencyhits[i];
+        fprintf(f, "bwdelay_latency_microseconds_bucket{le=\"%u\"} %lu\n", (i+1)*LATHIST_MAX_LATMS*1000/LATHIST_QUEUECOUNT - 1, cumul);
+    }
+    cumul += snap->latencyhits[LATHIST_QUEUECOUNT-1];
+    fprintf(f, "bwdelay_latency_microseconds_bucket{le=\"+Inf\"} %lu\n", cumul);
+    fprintf(f, "bwdelay_latency_microseconds_sum %ld\n", snap->latencysum);
+    fprintf(f, "bwdelay_latency_microseconds_count %lu\n", cumul);
+
+    /* Sweep buckets, same selection as printed upon exit */
+    if(progsettings.sweepmode) {
+        static const char *names[] = { "loss_percent", "delay_min_microseconds", "delay_max_microseconds", "delay_avg_microseconds", "samples" };
+        for(int m = 0; m < 5; m++) {
+            fprintf(f, "# HELP bwdelay_sweep_%s Sweep statistics per bandwidth bucket.\n# TYPE bwdelay_sweep_%s gauge\n", names[m], names[m]);
+            for(int i = 0; i < GRAPH_BWBUCKETS; i++) {
+                const struct bwdelaypoint *pt = &snap->bwdelaypoints[i];
+                if(pt->total_samples_for_this_bucket <= BUCKET_CONTENT_THRESH) {
+                    continue;
+                }
+                fprintf(f, "bwdelay_sweep_%s{bw_mbps=\"%u\"} ", names[m], GRAPHMAXBW*(i+1)/GRAPH_BWBUCKETS);
+                switch(m) {
+                case 0: fprintf(f, "%lf\n", pt->losspercent_cumul/(double)pt->total_samples_for_this_bucket); break;
+                case 1: fprintf(f, "%ld\n", pt->min_delay); break;
+                case 2: fprintf(f, "%ld\n", pt->max_delay); break;
+                case 3: fprintf(f, "%ld\n", pt->avg_delay_cumul/(int64_t)pt->total_samples_for_this_bucket); break;
+                case 4: fprintf(f, "%lu\n", pt->total_samples_for_this_bucket); break;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Exporter
+ * Wait until the client socket is ready for <events>, but not past the connection deadline (CLOCK_MONOTONIC ns)
+ */
+static bool waitExporterClient(int c, short events, uint64_t deadline)
+{
+    struct pollfd pfd = { .fd = c, .events = events };
+    while(1) {
+        uint64_t now = kernelclock_ns(CLOCK_MONOTONIC);
+        if(now >= deadline) {
+            return false;
+        }
+        int ret = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+        if(ret > 0) {
+            return true;
+        }
+        if(ret < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+static bool sendAll(int c, const char *data, size_t len, uint64_t deadline)
+{
+    while(len) {
+        if(!waitExporterClient(c, POLLOUT, deadline)) {
+            return false;
+        }
+        ssize_t ret = send(c, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(ret <= 0) {
+            if(ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/*
+ * Exporter
+ * Serve one HTTP request: GET /metrics (or /) returns the metrics, everything else a 404.
+ * The whole exchange must finish within EXPORTER_DEADLINE_MS, so a slow or stalled client cannot hold up other scrapes
+ */
+static void serveExporterClient(int c)
+{
+    uint64_t deadline = kernelclock_ns(CLOCK_MONOTONIC) + (uint64_t)EXPORTER_DEADLINE_MS*1000*1000;
+    static struct statssnapshot snap; /* Only used by the exporter thread */
+    char req[EXPORTER_REQBUFLEN];
+    size_t reqlen = 0;
+    char *body = NULL;
+    size_t bodylen = 0;
+    char hdr[256];
+    int hdrlen;
+
+    /* Read until the end of the request headers (the request has no body) */
+    while(reqlen < sizeof(req)-1) {
+        if(!waitExporterClient(c, POLLIN, deadline)) {
+            return;
+        }
+        ssize_t ret = recv(c, req + reqlen, sizeof(req)-1 - reqlen, MSG_DONTWAIT);
+        if(ret <= 0) {
+            if(ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            return;
+        }
+        reqlen += ret;
+        req[reqlen] = 0;
+        if(strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+    }
+    req[reqlen] = 0;
+
+    if(strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET / ", 6)) {
+        const char *notfound = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nNot Found\n";
+        sendAll(c, notfound, strlen(notfound), deadline);
+        return;
+    }
+
+    readStatsSnapshot(&snap);
+    FILE *f = open_memstream(&body, &bodylen);
+    if(!f) {
+        return;
+    }
+    writeMetrics(f, &snap);
+    fclose(f);
+
+    hdrlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", bodylen);
+    if(sendAll(c, hdr, hdrlen, deadline)) {
+        sendAll(c, body, bodylen, deadline);
+    }
+    free(body);
+}
+
+static void *exporterThread(void *arg)
+{
+    int s = (int)(intptr_t)arg;
+
+    /* Leave SIGINT (printing the histograms upon exit) to the receive path */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while(1) {
+        int c = accept(s, NULL, NULL);
+        if(c < 0) {
+            continue;
+        }
+        serveExporterClient(c);
+        close(c);
+    }
+    return NULL;
+}
+
+/*
+ * Exporter
+ * Serve the server statistics over HTTP from a separate thread, which only ever reads the snapshot copy.
+ * Must be started before the real-time settings are applied, so the thread does not inherit the CPU pinning and SCHED_FIFO.
+ */
+static void startExporter()
+{
+    struct sockaddr_in si_me;
+    pthread_t thread;
+    int s, one = 1;
+
+    if ((s=socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+    {
+        die("exporter socket");
+    }
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset((char *) &si_me, 0, sizeof(si_me));
+    si_me.sin_family = AF_INET;
+    si_me.sin_port = htons(progsettings.exporterport);
+    si_me.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if( bind(s , (struct sockaddr*)&si_me, sizeof(si_me) ) == -1)
+    {
+        die("exporter bind");
+    }
+    if(listen(s, 16) == -1)
+    {
+        die("exporter listen");
+    }
+
+    if(pthread_create(&thread, NULL, exporterThread, (void *)(intptr_t)s)) {
+        fprintf(stderr, "Failed to start exporter thread\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+
+    fprintf(stderr, "Serving Prometheus metrics on http://0.0.0.0:%d/metrics\n", progsettings.exporterport);
+}
+
+/*
+ * Latency percentiles of the current interval, from the per-interval histogram, in a single cumulative pass
+ */
+static void intervalpercentiles(uint64_t totpkts, bdt_shmrecord *rec)
+{
+    static const int permille[] = { 500, 900, 990, 999 };
+    int64_t *out[] = { &rec->p50_us, &rec->p90_us, &rec->p99_us, &rec->p999_us };
+    uint64_t cumul = 0;
+    int p = 0;
+
+    for(int i = 0; i < PCTL_QUEUECOUNT && p < 4; i++) {
+        cumul += latencyhits_intv[i];
+        while(p < 4 && cumul >= (totpkts * permille[p] + 999) / 1000) {
+            *out[p++] = (int64_t)(i+1)*PCTL_RES_US;
+        }
+    }
+    for(; p < 4; p++) {
+        *out[p] = (int64_t)PCTL_QUEUECOUNT*PCTL_RES_US;
+    }
+}
+
 /*
  * Fill in the packet content
  */
 static void prepPacket(bdt_pkt *pkt, int *outlen)
 {
     static uint64_t pktcounter;
-    struct timespec time1;
-    clock_gettime(progsettings.nonsyncedclocks ? CLOCK_MONOTONIC : CLOCK_REALTIME  , &time1);
 
     pkt->ctr = pktcounter++;
-    pkt->timestamp = time1.tv_sec * 1000000 + time1.tv_nsec/1000;
+    pkt->timestamp = gettime_ns(progsettings.nonsyncedclocks ? CLOCK_MONOTONIC : CLOCK_REALTIME)/1000;
     *outlen = progsettings.packetsize;
 }
 
@@ -266,13 +948,17 @@ static void parsePacket(bdt_pkt *pkt, int len)
     static int64_t maxdelay_last_intv;
     static int64_t avgdelay_last_intv;
     static uint64_t bytes_last_intv;
+    /* Part of the current interval which was already credited to a previous (exporter) session */
+    static uint64_t packets_credited_intv;
+    static uint64_t bytes_credited_intv;
+    static uint64_t drops_credited_intv;
+    static uint64_t drops_consq_credited_intv;
 
     int intv_ms = 100*1000; /* duration of the interval. For now hardcoded at 0.1s */
 
     uint64_t localtstamp;
-    struct timespec time1;
-    clock_gettime(progsettings.nonsyncedclocks ? CLOCK_MONOTONIC : CLOCK_REALTIME , &time1);
-    localtstamp = time1.tv_sec * 1000000 + time1.tv_nsec/1000;
+    clockid_t tstampclock = progsettings.nonsyncedclocks ? CLOCK_MONOTONIC : CLOCK_REALTIME;
+    localtstamp = gettime_ns(tstampclock)/1000;
 
     if(localoffset == 0 && progsettings.nonsyncedclocks) {
         /* Never calculated any offset set. Do it with the first incoming packet (assume it has +- 0 latency) */
@@ -305,6 +991,23 @@ static void parsePacket(bdt_pkt *pkt, int len)
             fprintf(stderr, "WARNING: Remote restarted. Restarting here too\n");
             rcvdpktcounter = pkt->ctr;
 
+            if(progsettings.exporterport) {
+                /* Credit the pending part of this interval to the session which ends here, before starting a new one */
+                sessionstats.packets += packets_last_intv - packets_credited_intv;
+                sessionstats.bytes += bytes_last_intv - bytes_credited_intv;
+                sessionstats.drops += drops_last_intv - drops_credited_intv;
+                sessionstats.drops_consq += drops_consq_last_intv - drops_consq_credited_intv;
+                packets_credited_intv = packets_last_intv;
+                bytes_credited_intv = bytes_last_intv;
+                drops_credited_intv = drops_last_intv;
+                drops_consq_credited_intv = drops_consq_last_intv;
+                publishStatsSnapshot();
+            }
+
+            /* Start a new session (keeping the peer, which the receive loop keeps up to date) */
+            sessionstats.session++;
+            sessionstats.packets = sessionstats.bytes = sessionstats.drops = sessionstats.drops_consq = 0;
+
             localoffset = 0;
             /* don't clear all the last-interval values -- will have one wrong measurement, which is ok since remote restarted */
             rcvdpktcounter++; /* Expect a new packet next time though */
@@ -313,6 +1016,14 @@ static void parsePacket(bdt_pkt *pkt, int len)
     }
     rcvdpktcounter++; /* Increase for next packet */
 
+    /* Per-interval histogram. Only counts packets which are also counted in packets_last_intv */
+    if(shmring) {
+        int pctlbucket = currentdelay/PCTL_RES_US;
+        if(pctlbucket >= PCTL_QUEUECOUNT) pctlbucket = PCTL_QUEUECOUNT-1;
+        if(pctlbucket < 0) pctlbucket = 0;
+        latencyhits_intv[pctlbucket]++;
+    }
+
     bytes_last_intv += len;
 
     /*
@@ -321,10 +1032,35 @@ static void parsePacket(bdt_pkt *pkt, int len)
     packets_last_intv++;
     if(localtstamp > lasttstamp_doneprint + intv_ms) {
         lasttstamp_doneprint = localtstamp;
+        latencysum += avgdelay_last_intv; /* Still the sum of all delays at this point */
         avgdelay_last_intv = avgdelay_last_intv / packets_last_intv;
-
-        /* Print gnuplot-friendly output */
-        printf("%lu %lu %lu %lu %ld %ld %ld\n", bytes_last_intv*(1000000/intv_ms), packets_last_intv*(1000000/intv_ms), drops_last_intv, drops_consq_last_intv, mindelay_last_intv, maxdelay_last_intv, avgdelay_last_intv );
+        uint64_t tscerr_last_intv = tsc_takeintervalerror(tstampclock);
+
+        if(shmring) {
+            /* Publish the record for live consumers. Never blocks on a slow reader */
+            bdt_shmrecord rec = {
+                .timestamp_us = localtstamp,
+                .bytes = bytes_last_intv*(1000000/intv_ms),
+                .packets = packets_last_intv*(1000000/intv_ms),
+                .drops = drops_last_intv,
+                .drops_consq = drops_consq_last_intv,
+                .mindelay_us = mindelay_last_intv,
+                .maxdelay_us = maxdelay_last_intv,
+                .avgdelay_us = avgdelay_last_intv,
+                .tscerr_ns = tscerr_last_intv,
+            };
+            intervalpercentiles(packets_last_intv, &rec);
+            bdt_shm_publish(shmring, &rec);
+            memset(latencyhits_intv, 0, sizeof(latencyhits_intv));
+        } else {
+            /* Print gnuplot-friendly output */
+            printf("%lu %lu %lu %lu %ld %ld %ld", bytes_last_intv*(1000000/intv_ms), packets_last_intv*(1000000/intv_ms), drops_last_intv, drops_consq_last_intv, mindelay_last_intv, maxdelay_last_intv, avgdelay_last_intv );
+            if(tscactive) {
+                /* Extra column: worst TSC to kernel clock conversion error seen during this interval */
+                printf(" %lu", tscerr_last_intv);
+            }
+            printf("\n");
+        }
 
         /*
          * Sweep mode:
@@ -348,6 +1084,22 @@ static void parsePacket(bdt_pkt *pkt, int len)
             }
         }
 
+        /*
+         * Exporter:
+         * Update the session counters, and hand a copy of the statistics to the exporter thread
+         */
+        if(progsettings.exporterport) {
+            sessionstats.packets += packets_last_intv - packets_credited_intv;
+            sessionstats.bytes += bytes_last_intv - bytes_credited_intv;
+            sessionstats.drops += drops_last_intv - drops_credited_intv;
+            sessionstats.drops_consq += drops_consq_last_intv - drops_consq_credited_intv;
+            sessionstats.mindelay_us = mindelay_last_intv;
+            sessionstats.maxdelay_us = maxdelay_last_intv;
+            sessionstats.avgdelay_us = avgdelay_last_intv;
+            publishStatsSnapshot();
+        }
+
+        packets_credited_intv = bytes_credited_intv = drops_credited_intv = drops_consq_credited_intv = 0;
         packets_last_intv = 0;
         drops_last_intv = 0;
         drops_consq_last_intv = 0;
@@ -355,7 +1107,7 @@ static void parsePacket(bdt_pkt *pkt, int len)
         mindelay_last_intv = currentdelay;
         avgdelay_last_intv = 0;
         bytes_last_intv = 0;
-        fflush(stdout);
+        if(!shmring) fflush(stdout);
 
     }
 }
@@ -365,17 +1117,16 @@ static void parsePacket(bdt_pkt *pkt, int len)
  */
 static void applypacketdelayincreaseifneeded(uint64_t *currentdelay, uint64_t maxdelay)
 {
-    static struct timespec lastchange;
+    static uint64_t lastchange;
     static int tickamount = 1;
     static bool seenonce = false;
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC , &now);
+    uint64_t now = gettime_ns(CLOCK_MONOTONIC);
     if(!seenonce) {
         seenonce = true;
         lastchange = now;
         *currentdelay = (maxdelay * BWDELAYGRAPHTICKS) / tickamount;
     }
-    if(now.tv_sec > lastchange.tv_sec + BWSWEEPTICKTIMESEC) {
+    if(now > lastchange + (uint64_t)BWSWEEPTICKTIMESEC*1000*1000*1000) {
         tickamount++;
         lastchange = now;
         if(tickamount > BWDELAYGRAPHTICKS) {
@@ -399,12 +1150,10 @@ static void performInterPacketDelay(int32_t target_perpacketdelay_ns)
      */
 
     static int64_t next_sendevent;
-    struct timespec now;
     int64_t now_ns;
     int64_t nextdelay;
 
-    clock_gettime(CLOCK_MONOTONIC , &now);
-    now_ns = now.tv_nsec + (uint64_t)now.tv_sec*1000*1000*1000;
+    now_ns = gettime_ns(CLOCK_MONOTONIC);
 
     if(!next_sendevent) {
         /* First time */
@@ -438,6 +1187,9 @@ static void runClient()
     uint64_t currentdelay_ns;
     uint64_t maxdelay_ns;
 
+    /* Pre-fault the packet buffer (real-time settings were already applied in main) */
+    memset(buf, 0, sizeof(buf));
+
     if ( (s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
     {
         die("socket");
@@ -558,6 +1310,11 @@ static void runServer()
     char buf[BUFLEN];
     bdt_pkt *pkt_p = (bdt_pkt*)buf;
     bool firstpktseen = false;
+    struct sockaddr_in lastpeer = { 0 };
+    int recvflags = progsettings.spinreceive ? MSG_DONTWAIT : 0;
+
+    /* Pre-fault the packet buffer (real-time settings were already applied in main) */
+    memset(buf, 0, sizeof(buf));
 
     /*create a UDP socket*/
     if ((s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
@@ -587,14 +1344,26 @@ static void runServer()
         }
     }
 
-    printf("# bytes_last_intv packets_last_intv drops_last_intv drops_consq_last_intv mindelayus_last_intv maxdelayus_last_intv avgdelayus_last_intv \n");
+    /*
+     * OPTIONAL
+     * Busy polling / spin receive, to avoid the wakeup latency of the blocking receive
+     */
+    applyRealtimeSocketSettings(s);
+
+    if(!shmring) {
+        printf("# bytes_last_intv packets_last_intv drops_last_intv drops_consq_last_intv mindelayus_last_intv maxdelayus_last_intv avgdelayus_last_intv %s\n",
+               tscactive ? "tscerrns_last_intv " : "");
+    }
 
     while(1)
     {
 
-        /* Do a blocking receive. */
-        if ((recv_len = recvfrom(s, buf, BUFLEN, 0, (struct sockaddr *) &si_other, &slen)) == -1)
+        /* Do a blocking receive (or keep polling in spin receive mode) */
+        if ((recv_len = recvfrom(s, buf, BUFLEN, recvflags, (struct sockaddr *) &si_other, &slen)) == -1)
         {
+            if(progsettings.spinreceive && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                continue;
+            }
             die("recvfrom()");
         }
 
@@ -607,6 +1376,15 @@ static void runServer()
         /* Parse the packet, and extract relevant data from it */
         parsePacket(pkt_p, recv_len);
 
+        /*
+         * Keep the exporter session label up to date.
+         * Only after parsePacket(), so a remote restart still publishes the final counters of the ending session under its own peer
+         */
+        if(progsettings.exporterport && (si_other.sin_addr.s_addr != lastpeer.sin_addr.s_addr || si_other.sin_port != lastpeer.sin_port)) {
+            lastpeer = si_other;
+            snprintf(sessionstats.peer, sizeof(sessionstats.peer), "%s:%d", inet_ntoa(si_other.sin_addr), ntohs(si_other.sin_port));
+        }
+
     }
 
     close(s);
@@ -619,8 +1397,8 @@ static void print_usage_and_exit() {
     printf("\n");
     printf(" Send IPv4 UDP packets containing timestamping information from sender to receiver, to determine received bandwidth and latency\n");
     printf("\t\n");
-    printf("\tClient Usage: %s -c <dstip> -p <packet size> [-d <interpacket_delay_ns> | -b <bandwidth_mbps>] [-s (sweepmode)] [-n (nonblocking mode)] [-i sourceinterfacebind] [-l <compensationlatencyms] [-a (async)]\n",  progsettings.prgname);
-    printf("\tServer Usage: %s  [-i sourceinterfacebind] [-s (sweepmode)] [-l <compensationlatencyms] [-a (async)]\n",  progsettings.prgname);
+    printf("\tClient Usage: %s -c <dstip> -p <packet size> [-d <interpacket_delay_ns> | -b <bandwidth_mbps>] [-s (sweepmode)] [-n (nonblocking mode)] [-i sourceinterfacebind] [-l <compensationlatencyms] [-a (async)] [-t (tsc)] [-C <cpu>] [-F <fifoprio>] [-m (mlock)]\n",  progsettings.prgname);
+    printf("\tServer Usage: %s  [-i sourceinterfacebind] [-s (sweepmode)] [-l <compensationlatencyms] [-a (async)] [-t (tsc)] [-C <cpu>] [-F <fifoprio>] [-m (mlock)] [-B <busypollus>] [-w (spinreceive)] [-o <shmfile>] [-e <exporterport>]\n",  progsettings.prgname);
     printf("\t \n");
     printf("\t \n");
     printf("\t -The targetbandwidth can be supplied either with -d or -b\n");
@@ -634,6 +1412,19 @@ static void print_usage_and_exit() {
     printf("\t -Optionally the target interface can be bound to using -i\n");
     printf("\t -Optionally the sender socket can be placed in non-blocking mode. (not necessairly useful)\n");
     printf("\t \n");
+    printf("\t -TSC mode reads timestamps from the invariant TSC instead of clock_gettime(), which is cheaper at high packet rates.\n");
+    printf("\t\t The TSC is calibrated and re-anchored every second to CLOCK_REALTIME (CLOCK_MONOTONIC in async mode), so timestamps keep their meaning.\n");
+    printf("\t\t The server adds an extra column with the worst conversion error (ns) per interval. Falls back to clock_gettime() without invariant TSC.\n");
+    printf("\t \n");
+    printf("\t -Real-time mode, to measure the network rather than scheduler noise. Each setting reports at startup whether it took effect:\n");
+    printf("\t\t -C pins the client/server to the given CPU, -F runs it with SCHED_FIFO at the given priority (1-99)\n");
+    printf("\t\t -m locks all memory (mlockall) and pre-faults the buffers and histograms\n");
+    printf("\t\t -B sets SO_BUSY_POLL (us) and SO_PREFER_BUSY_POLL on the server socket, -w makes the server spin on a non-blocking receive\n");
+    printf("\t \n");
+    printf("\t -Optionally the server publishes its interval records (plus latency percentiles) in a shared memory ring file with -o (e.g. /dev/shm/bwdelay),\n");
+    printf("\t\t instead of printing them. Tail it with bwdelayshmreader, as text or CSV.\n");
+    printf("\t -Optionally the server serves its statistics in Prometheus format on http://<server>:<exporterport>/metrics with -e\n");
+    printf("\t \n");
     printf("\t -The UDP port is hardcoded to " xstr(PORT) "\n");
     printf("\t \n");
     printf("\t Example client and server to send 1kB packets from 192.168.1.2 to 192.168.1.1, devices being time synced: \n");
@@ -644,6 +1435,21 @@ static void print_usage_and_exit() {
     exit(EXIT_FAILURE);
 }
 
+/*
+ * Parse a numeric option argument, and reject it up front if it is not a number in [min, max]
+ */
+static int parse_intarg(char option, const char *arg, long min, long max)
+{
+    char *end;
+    errno = 0;
+    long val = strtol(arg, &end, 10);
+    if(errno || end == arg || *end || val < min || val > max) {
+        printf("Invalid value '%s' for -%c (expected %ld..%ld)\n", arg, option, min, max);
+        print_usage_and_exit();
+    }
+    return val;
+}
+
 static void post_parse_argscheck()
 {
     /* Check that we have a consistent config */
@@ -661,6 +1467,24 @@ static void post_parse_argscheck()
             print_usage_and_exit();
             exit(EXIT_FAILURE);
         }
+
+        if(progsettings.busypollus || progsettings.spinreceive) {
+            printf("Busy polling and spin receive are only supported in server mode\n");
+            print_usage_and_exit();
+            exit(EXIT_FAILURE);
+        }
+
+        if(progsettings.shmfile) {
+            printf("Shared memory output is only supported in server mode\n");
+            print_usage_and_exit();
+            exit(EXIT_FAILURE);
+        }
+
+        if(progsettings.exporterport) {
+            printf("The metrics exporter is only supported in server mode\n");
+            print_usage_and_exit();
+            exit(EXIT_FAILURE);
+        }
     }
     return;
 }
@@ -684,7 +1508,8 @@ int main(int argc, char *argv[])
      * Parse options. Sanity check is done at the end
      */
     progsettings.prgname = argv[0];
-    while ((option = getopt(argc, argv,"c:d:p:l:ni:sab:")) != -1) {
+    progsettings.pincpu = -1;
+    while ((option = getopt(argc, argv,"c:d:p:l:ni:sab:tC:F:mB:wo:e:")) != -1) {
         switch (option) {
         case 'c':
             progsettings.clientmode = true;
@@ -714,6 +1539,30 @@ int main(int argc, char *argv[])
         case 'a':
             progsettings.nonsyncedclocks = true;
             break;
+        case 't':
+            progsettings.tsctimestamps = true;
+            break;
+        case 'C':
+            progsettings.pincpu = parse_intarg(option, optarg, 0, CPU_SETSIZE-1);
+            break;
+        case 'F':
+            progsettings.fifopriority = parse_intarg(option, optarg, 1, 99);
+            break;
+        case 'm':
+            progsettings.lockmemory = true;
+            break;
+        case 'B':
+            progsettings.busypollus = parse_intarg(option, optarg, 1, INT32_MAX);
+            break;
+        case 'w':
+            progsettings.spinreceive = true;
+            break;
+        case 'o':
+            progsettings.shmfile = optarg;
+            break;
+        case 'e':
+            progsettings.exporterport = parse_intarg(option, optarg, 1, 65535);
+            break;
         default:
             print_usage_and_exit();
             exit(EXIT_FAILURE);
@@ -723,6 +1572,22 @@ int main(int argc, char *argv[])
     /* Sanity check */
     post_parse_argscheck();
 
+    /* Optional metrics exporter. Started before the real-time settings are applied, so its thread does not inherit them */
+    if(progsettings.exporterport) {
+        startExporter();
+    }
+
+    /* OPTIONAL real-time settings. Pin before calibrating, so the TSC is calibrated on the CPU which does the measuring */
+    applyRealtimeSettings();
+
+    /* Select and calibrate the timestamp source */
+    tsc_init();
+
+    /* Optional shared memory output */
+    if(progsettings.shmfile) {
+        shm_init();
+    }
+
     /*
      * Start server/client mode
      */